@@ -50,19 +50,13 @@ OSVR_ReturnCode HardwareDetection::operator()(OSVR_PluginRegContext pContext) {
 
 OSVR_ReturnCode HardwareDetection::operator()(OSVR_PluginRegContext pContext, const char *params) {
     if(!mFound) {
-        // connect to device
-        if(!mTrackerDevice) {
-            mTrackerDevice = new TrackerDevice(pContext);
-        }
-        mFound = mTrackerDevice->tryInit();
-        if(mFound) {
-            // transfer ownership of mTrackerDevice to pContext
-            osvr::pluginkit::registerObjectForDeletion(pContext, mTrackerDevice);
-            mTrackerDevice = nullptr;
-        } else {
-            mLog->error() << "Device not detected.";
-            return OSVR_RETURN_FAILURE;
-        }
+        // The device finishes connecting to the tracker on its own update thread
+        // (retrying until it succeeds), so there's nothing to wait for here.
+        mTrackerDevice = new TrackerDevice(pContext);
+        // transfer ownership of mTrackerDevice to pContext
+        osvr::pluginkit::registerObjectForDeletion(pContext, mTrackerDevice);
+        mTrackerDevice = nullptr;
+        mFound = true;
     }
     return OSVR_RETURN_SUCCESS;
 }
@@ -42,22 +42,116 @@
 #include <chrono> // for std::chrono_literals
 #include <thread> // for std::thread, std::mutex, std::lock_guard
 #include <ostream> // for std::flush
+#include <future> // for std::async, std::future
+#include <fstream> // for std::ifstream, std::ofstream
+#include <cstdio> // for std::remove
+#include <cstdlib> // for std::getenv
 
 using namespace osvr::pluginkit;
 using namespace TobiiOSVR;
 
 class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
     protected:
-        bool mLastIsBlinkingSynced = false;
+        std::vector<BlinkEvent> mBlinkEventsSynced;
+        BlinkStateMachine mLeftBlink{LeftEye};
+        BlinkStateMachine mRightBlink{RightEye};
+        // tracker clock -> OSVR clock, see trackerTimeToOSVR
+        bool mHaveTrackerClockOffset = false;
+        int64_t mTrackerClockOffsetUs = 0;
+        int64_t mTrackerClockWindowMinOffsetUs = 0;
+        int64_t mTrackerClockWindowStartUs = 0;
+        static const int64_t kTrackerClockWindowUs = 5000000;
         GazeState mLastLeftEyeGazeStateSynced;
         GazeState mLastRightEyeGazeStateSynced;
+        bool mHaveFirstSampleSynced = false;
+        OSVR_TimeValue mFirstSampleTimeSynced;
         tobii_api_t* mAPI = nullptr;
         tobii_engine_t* mEngine = nullptr;
         tobii_device_t* mDevice = nullptr;
         bool mWearableSubscribed = false;
 
+        // result of the background tobii_api_create/tobii_engine_create started by beginInit
+        std::future<bool> mApiCreated;
+
         std::mutex mMutex;
 
+        // Last known-good device, persisted between server runs so startup can
+        // skip device enumeration and the stream capability query.
+        struct DeviceCache {
+            std::string url;
+            bool wearableSupported = false;
+        };
+
+        // Returns an empty path (cache disabled) if there's no per-user directory to put it in.
+        static std::string getDeviceCachePath() {
+            char const* dir = std::getenv("LOCALAPPDATA");
+            if(!dir) {
+                dir = std::getenv("TEMP");
+            }
+            if(!dir || *dir == '\0') {
+                return std::string();
+            }
+            return std::string(dir) + "\\osvr_tobii_device_cache.txt";
+        }
+
+        static bool loadDeviceCache(DeviceCache &cache) {
+            std::string path = getDeviceCachePath();
+            if(path.empty()) {
+                return false;
+            }
+            std::ifstream in(path);
+            int wearableSupported = 0;
+            if(!in || !std::getline(in, cache.url) || !(in >> wearableSupported)) {
+                return false;
+            }
+            cache.wearableSupported = wearableSupported != 0;
+            return !cache.url.empty();
+        }
+
+        void saveDeviceCache(DeviceCache const &cache) {
+            std::string path = getDeviceCachePath();
+            if(path.empty()) {
+                mLog->warn() << "Neither LOCALAPPDATA nor TEMP is set, not caching the Tobii device."
+                    << std::flush;
+                return;
+            }
+            std::ofstream out(path, std::ios::trunc);
+            out << cache.url << "\n" << (cache.wearableSupported ? 1 : 0) << "\n";
+            if(!out) {
+                mLog->warn() << "Could not write Tobii device cache to " << path << std::flush;
+            }
+        }
+
+        static void clearDeviceCache() {
+            std::string path = getDeviceCachePath();
+            if(!path.empty()) {
+                std::remove(path.c_str());
+            }
+        }
+
+        bool createApiAndEngine() {
+            tobii_error_t err = TOBII_ERROR_NO_ERROR;
+
+            if(!mAPI) {
+                err = tobii_api_create(&mAPI, nullptr, nullptr);
+                if(err != TOBII_ERROR_NO_ERROR) {
+                    logTobiiError("tobii_api_create", err);
+                    mAPI = nullptr;
+                    return false;
+                }
+            }
+
+            if(!mEngine) {
+                err = tobii_engine_create(mAPI, &mEngine);
+                if(err != TOBII_ERROR_NO_ERROR) {
+                    logTobiiError("tobii_engine_create", err);
+                    mEngine = nullptr;
+                    return false;
+                }
+            }
+            return true;
+        }
+
         static void url_receiver(char const* url, void* user_data) {
             //TobiiEyeTracker* _this = reinterpret_cast<TobiiEyeTracker>(user_data);
             // TODO: do something with this?
@@ -73,8 +167,8 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
 
         static bool convertGazeState(
 			tobii_wearable_eye_t const &eye,
-            GazeState& gazeState, 
-            bool &blinkState) {
+            OSVR_TimeValue const &timestamp,
+            GazeState& gazeState) {
             if(eye.gaze_origin_validity == TOBII_VALIDITY_INVALID ||
                eye.gaze_direction_validity == TOBII_VALIDITY_INVALID ||
                eye.eye_openness_validity == TOBII_VALIDITY_INVALID ||
@@ -96,32 +190,96 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
             osvrVec2SetX(&gazeState.gazePosition, eye.pupil_position_in_sensor_area_xy[0]);
             osvrVec2SetY(&gazeState.gazePosition, eye.pupil_position_in_sensor_area_xy[1]);
 
-            // TODO: what's a good threshold here? 0.5 is fully open
-            blinkState = (eye.eye_openness < 0.1 || eye.eye_openness > 0.9);
+            gazeState.timestamp = timestamp;
             return true;
         }
 
+        // Maps a sample's tracker timestamp onto the OSVR clock, so per-sample
+        // spacing (and thus blink durations) comes from the tracker, not from
+        // when the batch of callbacks happened to be processed.
+        //
+        // Every sample gives an upper bound on the offset (it can't have been
+        // taken after now), and the smallest one seen has the least processing
+        // latency in it. The offset is clamped to the current bound, so a mapped
+        // time is never in the future, and re-anchored to the smallest bound of
+        // each window so it follows drift between the two clocks.
+        // Caller must hold mMutex.
+        OSVR_TimeValue trackerTimeToOSVR(int64_t trackerUs) {
+            OSVR_TimeValue now;
+            osvrTimeValueGetNow(&now);
+            int64_t bound = static_cast<int64_t>(now.seconds) * 1000000 +
+                now.microseconds - trackerUs;
+
+            if(!mHaveTrackerClockOffset) {
+                mTrackerClockOffsetUs = bound;
+                mTrackerClockWindowMinOffsetUs = bound;
+                mTrackerClockWindowStartUs = trackerUs;
+                mHaveTrackerClockOffset = true;
+            }
+            if(bound < mTrackerClockOffsetUs) {
+                mTrackerClockOffsetUs = bound;
+            }
+            if(bound < mTrackerClockWindowMinOffsetUs) {
+                mTrackerClockWindowMinOffsetUs = bound;
+            }
+            if(trackerUs - mTrackerClockWindowStartUs >= kTrackerClockWindowUs) {
+                mTrackerClockOffsetUs = mTrackerClockWindowMinOffsetUs;
+                mTrackerClockWindowMinOffsetUs = bound;
+                mTrackerClockWindowStartUs = trackerUs;
+            }
+
+            int64_t us = trackerUs + mTrackerClockOffsetUs;
+            OSVR_TimeValue timestamp;
+            timestamp.seconds = us / 1000000;
+            timestamp.microseconds = static_cast<int32_t>(us % 1000000);
+            return timestamp;
+        }
+
+        // Runs the per-eye blink state machine on one sample, queueing any transition.
+        // Caller must hold mMutex.
+        void updateBlinkState(tobii_wearable_eye_t const &eye, BlinkStateMachine &blink,
+                              OSVR_TimeValue const &timestamp) {
+            BlinkEvent event;
+            bool changed = eye.eye_openness_validity == TOBII_VALIDITY_INVALID
+                ? blink.updateInvalid(timestamp, event)
+                : blink.update(eye.eye_openness, timestamp, event);
+            if(changed) {
+                mBlinkEventsSynced.push_back(event);
+            }
+        }
+
         // This callback is not gauranteed to be on the same thread as the one that subscribed
         // to these callbacks. Using mutex to protect access to synced variables.
         static void wearable_callback(tobii_wearable_data_t const* data, void* user_data) {
             TobiiEyeTracker* _this = reinterpret_cast<TobiiEyeTracker*>(user_data);
             std::lock_guard<std::mutex> lock(_this->mMutex);
-            bool leftIsBlinking, rightIsBlinking;
-            convertGazeState(data->left, _this->mLastLeftEyeGazeStateSynced, leftIsBlinking);
-            convertGazeState(data->right, _this->mLastRightEyeGazeStateSynced, rightIsBlinking);
-            _this->mLastIsBlinking = leftIsBlinking || rightIsBlinking;
-            // TODO: do we need to report left/right eye blinking separately?
+            OSVR_TimeValue timestamp = _this->trackerTimeToOSVR(data->timestamp_tracker_us);
+            bool leftValid = convertGazeState(data->left, timestamp, _this->mLastLeftEyeGazeStateSynced);
+            bool rightValid = convertGazeState(data->right, timestamp, _this->mLastRightEyeGazeStateSynced);
+            if((leftValid || rightValid) && !_this->mHaveFirstSampleSynced) {
+                osvrTimeValueGetNow(&_this->mFirstSampleTimeSynced);
+                _this->mHaveFirstSampleSynced = true;
+            }
+            _this->updateBlinkState(data->left, _this->mLeftBlink, timestamp);
+            _this->updateBlinkState(data->right, _this->mRightBlink, timestamp);
         }
 
-        std::string logTobiiError(std::string const &functionName, tobii_error_t errorCode) {
+        void logTobiiError(std::string const &functionName, tobii_error_t errorCode) {
             mLog->error() << "Tobii SDK function " << functionName 
                 << " returned the following error: " << tobii_error_message(errorCode)
                 << std::flush;
         }
 
     public:
-		TobiiEyeTracker() : EyeTrackerBase() {}
+		TobiiEyeTracker() : EyeTrackerBase() {
+            // report a zeroed, current-time state until the first valid sample
+            EyeTrackerBase::getLeftEyeGazeState(mLastLeftEyeGazeStateSynced);
+            EyeTrackerBase::getRightEyeGazeState(mLastRightEyeGazeStateSynced);
+        }
         virtual ~TobiiEyeTracker() {
+            if(mApiCreated.valid()) {
+                mApiCreated.wait();
+            }
             tobii_error_t err = TOBII_ERROR_NO_ERROR;
             if(mDevice) {
                 if(mWearableSubscribed) {
@@ -150,44 +308,59 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
             }
         }
 
+        virtual void beginInit() override {
+            if(mInitialized || mApiCreated.valid()) {
+                return;
+            }
+            mApiCreated = std::async(std::launch::async, [this] { return createApiAndEngine(); });
+        }
+
         virtual bool init() override {
             if(mInitialized) {
                 return true;
             }
             tobii_error_t err = TOBII_ERROR_NO_ERROR;
-            
-            if(!mAPI) {
-                err = tobii_api_create(&mAPI, nullptr, nullptr);
-                if(err != TOBII_ERROR_NO_ERROR) {
-                    logTobiiError("tobii_api_create", err);
-                    mAPI = nullptr;
-                    return false;
-                }
-            }
 
-            if(!mEngine) {
-                err = tobii_engine_create(mAPI, &mEngine);
-                if(err != TOBII_ERROR_NO_ERROR) {
-                    logTobiiError("tobii_engine_create", err);
-                    mEngine = nullptr;
+            // join the background creation if beginInit started one (its errors are
+            // already logged); otherwise, e.g. on a retry after it failed, create synchronously
+            if(mApiCreated.valid()) {
+                if(!mApiCreated.get()) {
                     return false;
                 }
+            } else if(!createApiAndEngine()) {
+                return false;
             }
             
             // for now, only try once per device
             if(!mDevice) {
-                char url[256] = {0};
-                err = tobii_enumerate_local_device_urls(mAPI, url_receiver, url);
-                if(err != TOBII_ERROR_NO_ERROR) {
-                    logTobiiError("tobii_enumerate_local_device_urls", err);
-                    return false;
+                DeviceCache cache;
+                bool fromCache = loadDeviceCache(cache);
+                if(fromCache) {
+                    err = tobii_device_create(mAPI, cache.url.c_str(), &mDevice);
+                    if(err != TOBII_ERROR_NO_ERROR) {
+                        mLog->info() << "Cached Tobii device " << cache.url
+                            << " is not available, enumerating devices." << std::flush;
+                        mDevice = nullptr;
+                        fromCache = false;
+                    }
                 }
 
-                err = tobii_device_create(mAPI, url, &mDevice);
-                if(err != TOBII_ERROR_NO_ERROR) {
-                    logTobiiError("tobii_device_create", err);
-                    mDevice = nullptr;
-                    return false;
+                if(!mDevice) {
+                    char url[256] = {0};
+                    err = tobii_enumerate_local_device_urls(mAPI, url_receiver, url);
+                    if(err != TOBII_ERROR_NO_ERROR) {
+                        logTobiiError("tobii_enumerate_local_device_urls", err);
+                        return false;
+                    }
+
+                    err = tobii_device_create(mAPI, url, &mDevice);
+                    if(err != TOBII_ERROR_NO_ERROR) {
+                        logTobiiError("tobii_device_create", err);
+                        mDevice = nullptr;
+                        return false;
+                    }
+                    cache.url = url;
+                    cache.wearableSupported = false;
                 }
 
                 err = tobii_device_clear_callback_buffers(mDevice);
@@ -196,16 +369,21 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
                     return false; // TODO: Do we actually need to return false here?
                 }
 
-                tobii_supported_t supported = TOBII_NOT_SUPPORTED;
-                err = tobii_stream_supported(mDevice, TOBII_STREAM_WEARABLE, &supported);
-                if(err != TOBII_ERROR_NO_ERROR) {
-                    logTobiiError("tobii_stream_supported", err);
-                    return false;
-                }
-                if(supported == TOBII_NOT_SUPPORTED) {
-                    mLog->error() << "Tobii device reports that it does not support the TOBII_STREAM_WEARABLE stream type."
-                        << " TOBII_STREAM_WEARABLE is required for OSVR-Tobii." << std::flush;
-                    return false;
+                if(!fromCache || !cache.wearableSupported) {
+                    tobii_supported_t supported = TOBII_NOT_SUPPORTED;
+                    err = tobii_stream_supported(mDevice, TOBII_STREAM_WEARABLE, &supported);
+                    if(err != TOBII_ERROR_NO_ERROR) {
+                        logTobiiError("tobii_stream_supported", err);
+                        return false;
+                    }
+                    if(supported == TOBII_NOT_SUPPORTED) {
+                        mLog->error() << "Tobii device reports that it does not support the TOBII_STREAM_WEARABLE stream type."
+                            << " TOBII_STREAM_WEARABLE is required for OSVR-Tobii." << std::flush;
+                        clearDeviceCache();
+                        return false;
+                    }
+                    cache.wearableSupported = true;
+                    saveDeviceCache(cache);
                 }
             }
 
@@ -213,11 +391,14 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
                 err = tobii_wearable_data_subscribe(mDevice, wearable_callback, this);
                 if(err != TOBII_ERROR_NO_ERROR) {
                     logTobiiError("tobii_wearable_data_subscribe", err);
+                    // don't trust the cached device next time around
+                    clearDeviceCache();
                     return false;
                 }
                 mWearableSubscribed = true;
             }
             mInitialized = true;
+            return true;
         }
 
         virtual bool waitForData() override {
@@ -255,9 +436,16 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
             gazeState = mLastRightEyeGazeStateSynced;
         }
 
-        virtual bool getIsBlinking() override {
+        virtual bool getFirstSampleTime(OSVR_TimeValue &timestamp) override {
+            std::lock_guard<std::mutex> lock(mMutex);
+            timestamp = mFirstSampleTimeSynced;
+            return mHaveFirstSampleSynced;
+        }
+
+        virtual void takeBlinkEvents(std::vector<BlinkEvent> &events) override {
+            events.clear();
             std::lock_guard<std::mutex> lock(mMutex);
-            return mLastIsBlinkingSynced;
+            events.swap(mBlinkEventsSynced);
         }
 
 };
@@ -265,6 +453,13 @@ class TobiiEyeTracker : public ::TobiiOSVR::EyeTrackerBase {
 TrackerDevice::TrackerDevice(OSVR_PluginRegContext pContext) {
 	mLog = osvr::util::log::make_logger(EYE_TRACKER_LOG);
 
+    osvrTimeValueGetNow(&mStartTime);
+
+    // Kick off SDK bring-up in the background. The rest of init happens on the
+    // device thread in update(), so registration never waits on the hardware.
+    mEyeTracker = std::make_shared<TobiiEyeTracker>();
+    mEyeTracker->beginInit();
+
     OSVR_DeviceInitOptions options = osvrDeviceCreateInitOptions(pContext);
     osvrDeviceEyeTrackerConfigure(options, &mEyeTrackerInterface, NumEyeTrackerChannels);
 
@@ -272,8 +467,6 @@ TrackerDevice::TrackerDevice(OSVR_PluginRegContext pContext) {
 
     mDeviceToken.sendJsonDescriptor(org_osvr_Tobii_json);
 
-    this->tryInit();
-
     mDeviceToken.registerUpdateCallback(this);
 }
 
@@ -281,10 +474,8 @@ bool TrackerDevice::tryInit() {
     if(mInitialized) {
         return true;
     }
-    if(!mEyeTracker) {
-        mEyeTracker = std::make_shared<EyeTrackerBase>();
-    }
 
+    osvrTimeValueGetNow(&mInitAttemptStart);
     if(!mEyeTracker->init()) {
         mLog->warn() << "Could not initialize tobii eye tracker. Will try again later."
             << std::flush;
@@ -297,9 +488,22 @@ bool TrackerDevice::tryInit() {
 TrackerDevice::~TrackerDevice() {}
 
 OSVR_ReturnCode TrackerDevice::update() {
-    OSVR_TimeValue timestamp;
-    osvrTimeValueGetNow(&timestamp);
+    if(!tryInit()) {
+        // don't spin the device thread while the tracker is unavailable
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        return OSVR_RETURN_SUCCESS;
+    }
+
     if(mEyeTracker->waitForData()) {
+        OSVR_TimeValue firstSampleTime;
+        if(!mReportedFirstSample && mEyeTracker->getFirstSampleTime(firstSampleTime)) {
+            mLog->info() << "First gaze sample arrived "
+                << osvrTimeValueDurationSeconds(&firstSampleTime, &mStartTime) * 1000.0
+                << " ms after startup ("
+                << osvrTimeValueDurationSeconds(&firstSampleTime, &mInitAttemptStart) * 1000.0
+                << " ms after the successful init attempt began)" << std::flush;
+            mReportedFirstSample = true;
+        }
 
         GazeState leftGazeState, rightGazeState;
         mEyeTracker->getLeftEyeGazeState(leftGazeState);
@@ -311,7 +515,7 @@ OSVR_ReturnCode TrackerDevice::update() {
             leftGazeState.gazeDirection,
             leftGazeState.gazeBasePoint,
             LeftEyeTrackerChannel,
-            &timestamp);
+            &leftGazeState.timestamp);
         
         osvrDeviceEyeTrackerReportGaze(
             mEyeTrackerInterface,
@@ -319,11 +523,20 @@ OSVR_ReturnCode TrackerDevice::update() {
             rightGazeState.gazeDirection,
             rightGazeState.gazeBasePoint,
             RightEyeTrackerChannel,
-            &timestamp);
-
-        if (mLastIsBlinking != mEyeTracker->getIsBlinking()) {
-            mLastIsBlinking = mEyeTracker->getIsBlinking();
-            osvrDeviceEyeTrackerReportBlink(mEyeTrackerInterface, mLastIsBlinking, BlinkChannel, &timestamp);
+            &rightGazeState.timestamp);
+
+        mEyeTracker->takeBlinkEvents(mBlinkEvents);
+        for(auto const &event : mBlinkEvents) {
+            // OSVR blink reports carry no duration, so it only goes to the log
+            if(!event.isBlinking) {
+                mLog->debug() << (event.eye == LeftEye ? "Left" : "Right") << " eye blink lasted "
+                    << event.durationSeconds * 1000.0 << " ms" << std::flush;
+            }
+            osvrDeviceEyeTrackerReportBlink(
+                mEyeTrackerInterface,
+                event.isBlinking,
+                event.eye == LeftEye ? LeftBlinkChannel : RightBlinkChannel,
+                &event.timestamp);
         }
     }
 
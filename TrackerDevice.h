@@ -36,6 +36,7 @@
 #include <osvr/ClientKit/InterfaceC.h>
 #include <osvr/Util/Vec2C.h>
 #include <osvr/Util/Vec3C.h>
+#include <osvr/Util/TimeValueC.h>
 #include <osvr/Util/Log.h>
 
 // Standard includes
@@ -43,6 +44,7 @@
 #include <thread>
 #include <mutex>
 #include <string>
+#include <vector>
 
 namespace TobiiOSVR {
 	
@@ -50,14 +52,96 @@ namespace TobiiOSVR {
 		OSVR_EyeGazePosition2DState gazePosition;
 		OSVR_EyeGazeDirectionState gazeDirection;
 		OSVR_EyeGazeBasePoint3DState gazeBasePoint;
+		OSVR_TimeValue timestamp; // when the sample was taken, on the OSVR clock
 	} GazeState;
 
+    enum Eye {
+        LeftEye,
+        RightEye,
+
+        NumEyes
+    };
+
+    /// A blink start (isBlinking == true) or end transition for one eye.
+    /// durationSeconds is only meaningful for end events.
+    typedef struct {
+        Eye eye;
+        bool isBlinking;
+        OSVR_TimeValue timestamp;
+        double durationSeconds;
+    } BlinkEvent;
+
+    /// Per-eye blink detection with hysteresis on eye openness, so a
+    /// noisy openness value near a single threshold doesn't chatter.
+    class BlinkStateMachine {
+    public:
+        /// openness below this starts a blink
+        static constexpr float kClosedThreshold = 0.1f;
+        /// openness above this ends a blink
+        static constexpr float kOpenThreshold = 0.3f;
+        /// a blink still open after this long without valid openness data is ended
+        static constexpr double kInvalidTimeoutSeconds = 0.5;
+
+        explicit BlinkStateMachine(Eye eye) : mEye(eye) {}
+
+        /// Feed one openness sample. Returns true and fills event on a transition.
+        bool update(float openness, OSVR_TimeValue const &timestamp, BlinkEvent &event) {
+            mHaveInvalidSince = false;
+            bool blinking = mBlinking ? openness < kOpenThreshold
+                                      : openness < kClosedThreshold;
+            if(blinking == mBlinking) {
+                return false;
+            }
+            mBlinking = blinking;
+            event.eye = mEye;
+            event.isBlinking = blinking;
+            event.timestamp = timestamp;
+            event.durationSeconds = 0.0;
+            if(blinking) {
+                mBlinkStart = timestamp;
+            } else {
+                event.durationSeconds = osvrTimeValueDurationSeconds(&timestamp, &mBlinkStart);
+            }
+            return true;
+        }
+
+        /// Feed a sample with no valid openness. If the eye has been blinking and
+        /// the data stays invalid (tracking lost, headset removed), ends the blink
+        /// so the channel can't get stuck. Returns true and fills event if so.
+        bool updateInvalid(OSVR_TimeValue const &timestamp, BlinkEvent &event) {
+            if(!mBlinking) {
+                return false;
+            }
+            if(!mHaveInvalidSince) {
+                mInvalidSince = timestamp;
+                mHaveInvalidSince = true;
+                return false;
+            }
+            if(osvrTimeValueDurationSeconds(&timestamp, &mInvalidSince) < kInvalidTimeoutSeconds) {
+                return false;
+            }
+            mBlinking = false;
+            mHaveInvalidSince = false;
+            event.eye = mEye;
+            event.isBlinking = false;
+            event.timestamp = timestamp;
+            event.durationSeconds = osvrTimeValueDurationSeconds(&timestamp, &mBlinkStart);
+            return true;
+        }
+
+    private:
+        Eye mEye;
+        bool mBlinking = false;
+        OSVR_TimeValue mBlinkStart = {0, 0};
+        bool mHaveInvalidSince = false;
+        OSVR_TimeValue mInvalidSince = {0, 0};
+    };
+
     class EyeTrackerBase {
         protected:
             
             osvr::util::log::LoggerPtr mLog;
 
-            bool mLastIsBlinking = false;
             bool mInitialized = false;
         public:
 			EyeTrackerBase() {
@@ -66,6 +150,10 @@ namespace TobiiOSVR {
 
             virtual ~EyeTrackerBase() {}
 
+            /// Starts any slow, device-independent setup in the background so
+            /// it can overlap with OSVR device registration. init() waits for it.
+            virtual void beginInit() {}
+
             virtual bool init() {
                 return mInitialized;
             }
@@ -78,17 +166,25 @@ namespace TobiiOSVR {
                 osvrVec2Zero(&gazeState.gazePosition);
                 osvrVec3Zero(&gazeState.gazeDirection);
                 osvrVec3Zero(&gazeState.gazeBasePoint);
+                osvrTimeValueGetNow(&gazeState.timestamp);
             }
 
             virtual void getRightEyeGazeState(GazeState &gazeState) {
                 osvrVec2Zero(&gazeState.gazePosition);
                 osvrVec3Zero(&gazeState.gazeDirection);
                 osvrVec3Zero(&gazeState.gazeBasePoint);
+                osvrTimeValueGetNow(&gazeState.timestamp);
             }
 
-            virtual bool getIsBlinking() {
-                mLastIsBlinking = !mLastIsBlinking;
-                return mLastIsBlinking;
+            /// Returns false until the first valid gaze sample has arrived,
+            /// then fills timestamp with the time it arrived.
+            virtual bool getFirstSampleTime(OSVR_TimeValue &timestamp) {
+                return false;
+            }
+
+            /// Moves any blink events produced since the last call into events.
+            virtual void takeBlinkEvents(std::vector<BlinkEvent> &events) {
+                events.clear();
             }
     };
 
@@ -99,8 +195,9 @@ namespace TobiiOSVR {
         OSVR_ReturnCode operator()(OSVR_PluginRegContext pContext);
         OSVR_ReturnCode update();
 
-        bool tryInit();
     private:
+        /// Finishes eye tracker init; only called from update() on the device thread.
+        bool tryInit();
 
         enum EyeTrackerChannel {
             LeftEyeTrackerChannel,
@@ -110,7 +207,8 @@ namespace TobiiOSVR {
         };
 
 		enum BlinkChannel {
-			BlinkChannel,
+			LeftBlinkChannel,
+			RightBlinkChannel,
 
 			NumBlinkChannels
 		};
@@ -123,7 +221,12 @@ namespace TobiiOSVR {
 		osvr::pluginkit::DeviceToken mDeviceToken;
 
 		std::shared_ptr<EyeTrackerBase> mEyeTracker;
-		bool mLastIsBlinking = false;
+		std::vector<BlinkEvent> mBlinkEvents;
+
+		// startup metric: time from construction to the first gaze sample
+		OSVR_TimeValue mStartTime;
+		OSVR_TimeValue mInitAttemptStart;
+		bool mReportedFirstSample = false;
     };
 }
 